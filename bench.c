@@ -0,0 +1,648 @@
+// parameterized benchmark for src/hashmap.h.
+// cc -std=gnu11 -O2 -pthread bench.c -o bench -lm
+// compile-time knobs (-DHASHMAP_CTRL=1, -DHASHMAP_MIN_RESERVE=64, ...) are
+// passed on the command line; run-time parameters are listed by ./bench -h.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "src/hashmap.h"
+
+static inline uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &(now));
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// latency histogram: values below 2^HIST_SUB_BITS ns are exact, larger ones are
+// bucketed by power of two with 2^HIST_SUB_BITS linear sub-buckets (~3% error).
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_N ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count[HIST_N];
+	uint64_t n;
+	uint64_t max;
+};
+
+static inline size_t hist_idx(uint64_t v) {
+	if (v < HIST_SUB) {
+		return v;
+	}
+	unsigned int log2 = 63 - __builtin_clzll(v);
+	unsigned int shift = log2 - HIST_SUB_BITS;
+	return (size_t)(shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+static inline uint64_t hist_value(size_t idx) {
+	if (idx < HIST_SUB) {
+		return idx;
+	}
+	unsigned int shift = idx / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + idx % HIST_SUB) << shift) + ((uint64_t)1 << shift) / 2;
+}
+static inline void hist_add(struct hist *hist, uint64_t v) {
+	hist->count[hist_idx(v)] += 1;
+	hist->n += 1;
+	if (v > hist->max) {
+		hist->max = v;
+	}
+}
+static void hist_merge(struct hist *into, struct hist *from) {
+	for (size_t idx = 0; idx < HIST_N; ++idx) {
+		into->count[idx] += from->count[idx];
+	}
+	into->n += from->n;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+static uint64_t hist_percentile(struct hist *hist, double p) {
+	uint64_t target = (uint64_t)ceil(hist->n * p), seen = 0;
+	for (size_t idx = 0; idx < HIST_N; ++idx) {
+		seen += hist->count[idx];
+		if (seen >= target && seen != 0) {
+			return hist_value(idx);
+		}
+	}
+	return hist->max;
+}
+
+// xorshift*
+static inline uint64_t rng_next(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dull;
+}
+static inline double rng_unit(uint64_t *state) {
+	return (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+enum dist {
+	dist_uniform,
+	dist_zipf,
+	dist_seq,
+};
+
+// zipfian ranks as in gray et al., "quickly generating billion-record
+// synthetic databases" (also what ycsb uses). rank 0 is the hottest key.
+struct zipf {
+	uint64_t n;
+	double theta, alpha, zetan, eta;
+};
+static void zipf_init(struct zipf *zipf, uint64_t n, double theta) {
+	double zetan = 0;
+	for (uint64_t it = 1; it <= n; ++it) {
+		zetan += 1 / pow((double)it, theta);
+	}
+	double zeta2 = 1 + 1 / pow(2, theta);
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->alpha = 1 / (1 - theta);
+	zipf->zetan = zetan;
+	zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+static inline uint64_t zipf_next(struct zipf *zipf, uint64_t *state) {
+	double u = rng_unit(state), uz = u * zipf->zetan;
+	if (uz < 1) {
+		return 0;
+	}
+	if (uz < 1 + pow(0.5, zipf->theta)) {
+		return 1;
+	}
+	uint64_t rank = (uint64_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+	return rank >= zipf->n ? zipf->n - 1 : rank;
+}
+
+static struct {
+	unsigned int n_threads;
+	uint64_t n_keys;
+	uint64_t n_ops;
+	uint32_t key_sz;
+	enum dist dist;
+	double zipf_theta;
+	unsigned int read_pct, write_pct, delete_pct;
+	int initial_size_log2;
+	float resize_percentage;
+	float shrink_percentage;
+	unsigned int sample;
+	bool preload;
+	bool ensure_capacity;
+	bool fetch_add;
+	unsigned int shard_bits;
+	uint32_t wait_spins, wait_backoff;
+} opt = {
+	.n_threads = 8,
+	.n_keys = 1 << 22,
+	.n_ops = 1 << 24,
+	.key_sz = 8,
+	.dist = dist_uniform,
+	.zipf_theta = 0.99,
+	.read_pct = 90, .write_pct = 9, .delete_pct = 1,
+	.initial_size_log2 = -1,
+	.resize_percentage = 0.94,
+	.shrink_percentage = 0,
+	.sample = 1,
+	.preload = true,
+	.ensure_capacity = false,
+	.fetch_add = false,
+	.shard_bits = 0,
+	.wait_spins = HASHMAP_WAIT_SPINS, .wait_backoff = HASHMAP_WAIT_BACKOFF,
+};
+
+// exactly one of these is set; the_sharded with -S
+static struct hashmap *the_hashmap;
+static struct hashmap_sharded *the_sharded;
+static struct zipf the_zipf;
+
+enum op {
+	op_read,
+	op_write,
+	op_delete,
+	op_n,
+};
+static const char *op_name[op_n] = { "read", "write", "delete", };
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	uint64_t seed;
+	struct hist hist[op_n];
+	uint64_t ops[op_n];
+	// ops that did not return hashmap_cas_error
+	uint64_t hits[op_n];
+	// how long destroy_thread spent in hashmap_clear_parallel
+	uint64_t destroy_ns;
+};
+
+static atomic_uint_fast64_t seq_next;
+static pthread_barrier_t start_barrier;
+
+// the first 8 bytes of a key are its index; shorter keys start with the
+// low 32 bits instead. either way, the rest is padded with bytes derived from it.
+static inline void make_key(uint64_t idx, unsigned char *buf) {
+	uint32_t it;
+	if (opt.key_sz < 8) {
+		uint32_t idx32 = (uint32_t)idx;
+		memcpy(buf, &(idx32), sizeof(idx32));
+		it = sizeof(idx32);
+	} else {
+		memcpy(buf, &(idx), sizeof(idx));
+		it = sizeof(idx);
+	}
+	for (; it < opt.key_sz; ++it) {
+		buf[it] = (unsigned char)(idx * 0x9e3779b97f4a7c15ull >> (it % 8 * 8));
+	}
+}
+
+static inline uint64_t next_idx(uint64_t *state) {
+	switch (opt.dist) {
+		case dist_uniform: {
+			return rng_next(state) % opt.n_keys;
+		}
+		case dist_zipf: {
+			return zipf_next(&(the_zipf), state);
+		}
+		case dist_seq: {
+			return atomic_fetch_add_explicit(&(seq_next), 1, memory_order_relaxed) % opt.n_keys;
+		}
+	}
+	return 0;
+}
+
+static void *bench_area(void) {
+	if (the_sharded != NULL) {
+		return hashmap_sharded_area(the_sharded);
+	}
+	return hashmap_area(the_hashmap);
+}
+static void bench_area_release(void *area) {
+	if (the_sharded != NULL) {
+		hashmap_sharded_area_release(the_sharded, area);
+	} else {
+		hashmap_area_release(the_hashmap, area);
+	}
+}
+static inline enum hashmap_cas_result bench_cas(
+	void *area,
+	struct hashmap_key *key,
+	void **expected,
+	void *new_value,
+	enum hashmap_cas_option option
+) {
+	if (the_sharded != NULL) {
+		return hashmap_sharded_cas(the_sharded, area, key, expected, new_value, option, NULL);
+	}
+	return hashmap_cas(the_hashmap, area, key, expected, new_value, option, NULL);
+}
+static inline enum hashmap_cas_result bench_fetch_add(
+	void *area,
+	struct hashmap_key *key,
+	intptr_t delta
+) {
+	if (the_sharded != NULL) {
+		size_t shard = hashmap_sharded_shard(the_sharded, key);
+		return hashmap_fetch_add(
+			the_sharded->shards[shard], ((struct hashmap_sharded_area *)area)->areas[shard], key,
+			delta, NULL
+		);
+	}
+	return hashmap_fetch_add(the_hashmap, area, key, delta, NULL);
+}
+// sums the stats of every shard. returns the total number of buckets,
+// which may not fit stats->n_buckets
+static uint64_t bench_stats(struct hashmap_stats *stats) {
+	if (the_sharded == NULL) {
+		hashmap_stats(the_hashmap, stats);
+		return stats->n_buckets;
+	}
+	memset(stats, 0, sizeof(*stats));
+	uint64_t n_buckets = 0, occupied_buckets = 0;
+	for (size_t shard = 0; shard < ((size_t)1 << opt.shard_bits); ++shard) {
+		struct hashmap_stats shard_stats;
+		hashmap_stats(the_sharded->shards[shard], &(shard_stats));
+		for (size_t idx = 0; idx < HASHMAP_CAS_N_OPTIONS; ++idx) {
+			stats->ops[idx] += shard_stats.ops[idx];
+		}
+		for (size_t idx = 0; idx < HASHMAP_STATS_PSL_N; ++idx) {
+			stats->psl[idx] += shard_stats.psl[idx];
+		}
+		stats->lock_spins += shard_stats.lock_spins;
+		stats->lock_parks += shard_stats.lock_parks;
+		stats->reserve_refills += shard_stats.reserve_refills;
+		stats->resizes += shard_stats.resizes;
+		stats->resize_ns += shard_stats.resize_ns;
+		stats->resize_wait_ns += shard_stats.resize_wait_ns;
+		n_buckets += shard_stats.n_buckets;
+		occupied_buckets += shard_stats.occupied_buckets;
+	}
+	stats->occupied_buckets = occupied_buckets;
+	stats->load_factor = (double)occupied_buckets / n_buckets;
+	return n_buckets;
+}
+
+static inline enum hashmap_cas_result do_op(
+	void *area,
+	enum op op,
+	uint64_t idx
+) {
+	unsigned char buf[256];
+	struct hashmap_key key;
+	make_key(idx, buf);
+	hashmap_key(buf, opt.key_sz, &(key));
+
+	void *value = (void *)(uintptr_t)(idx + 1);
+	void *expected = value;
+	switch (op) {
+		case op_read: {
+			return bench_cas(area, &(key), &(expected), NULL, hashmap_cas_get);
+		}
+		case op_write: {
+			if (opt.fetch_add) {
+				// a counter increment (which inserts an absent key)
+				return bench_fetch_add(area, &(key), 1);
+			}
+			// values never change, so this replaces a present key and inserts an absent one
+			return bench_cas(area, &(key), &(expected), value, hashmap_cas_set);
+		}
+		default: {
+			// a non-NULL new_value makes the delete unconditional
+			return bench_cas(area, &(key), &(expected), value, hashmap_cas_delete);
+		}
+	}
+}
+
+static void *preload_thread(void *arg) {
+	struct worker *worker = arg;
+	void *area = bench_area();
+	pthread_barrier_wait(&(start_barrier));
+	for (uint64_t idx = worker->id; idx < opt.n_keys; idx += opt.n_threads) {
+		uint64_t start = 0;
+		bool sampled = idx % opt.sample == 0;
+		if (sampled) {
+			start = now_ns();
+		}
+		if (do_op(area, op_write, idx) != hashmap_cas_success) {
+			fprintf(stderr, "preload of key %lu failed\n", (unsigned long)idx);
+			exit(1);
+		}
+		if (sampled) {
+			hist_add(&(worker->hist[op_write]), now_ns() - start);
+		}
+		worker->ops[op_write] += 1;
+		worker->hits[op_write] += 1;
+	}
+	bench_area_release(area);
+	return NULL;
+}
+
+static void *mixed_thread(void *arg) {
+	struct worker *worker = arg;
+	void *area = bench_area();
+	uint64_t n_ops = opt.n_ops / opt.n_threads;
+	pthread_barrier_wait(&(start_barrier));
+	for (uint64_t it = 0; it < n_ops; ++it) {
+		unsigned int roll = rng_next(&(worker->seed)) % 100;
+		enum op op = roll < opt.read_pct ? op_read : roll < opt.read_pct + opt.write_pct ? op_write : op_delete;
+		uint64_t idx = next_idx(&(worker->seed));
+
+		uint64_t start = 0;
+		bool sampled = it % opt.sample == 0;
+		if (sampled) {
+			start = now_ns();
+		}
+		enum hashmap_cas_result result = do_op(area, op, idx);
+		if (sampled) {
+			hist_add(&(worker->hist[op]), now_ns() - start);
+		}
+		if (result != hashmap_cas_error) {
+			worker->hits[op] += 1;
+		}
+		worker->ops[op] += 1;
+	}
+	bench_area_release(area);
+	return NULL;
+}
+
+static struct hashmap_clear_parallel destroy_job;
+
+static void *destroy_thread(void *arg) {
+	struct worker *worker = arg;
+	pthread_barrier_wait(&(start_barrier));
+	// each worker times itself, since the main thread may only
+	// get past the barrier after the others have finished
+	uint64_t start = now_ns();
+	hashmap_clear_parallel(&(destroy_job));
+	worker->destroy_ns = now_ns() - start;
+	return NULL;
+}
+
+static void run_phase(const char *name, struct worker *workers, void *(*fn)(void *)) {
+	for (unsigned int it = 0; it < opt.n_threads; ++it) {
+		struct worker *worker = &(workers[it]);
+		memset(worker->hist, 0, sizeof(worker->hist));
+		memset(worker->ops, 0, sizeof(worker->ops));
+		memset(worker->hits, 0, sizeof(worker->hits));
+		pthread_create(&(worker->thread), NULL, fn, worker);
+	}
+	pthread_barrier_wait(&(start_barrier));
+	uint64_t start = now_ns();
+	for (unsigned int it = 0; it < opt.n_threads; ++it) {
+		pthread_join(workers[it].thread, NULL);
+	}
+	double elapsed = (now_ns() - start) * 1e-9;
+
+	struct hist total[op_n];
+	uint64_t ops[op_n] = { 0 }, hits[op_n] = { 0 }, total_ops = 0;
+	memset(total, 0, sizeof(total));
+	for (unsigned int it = 0; it < opt.n_threads; ++it) {
+		for (size_t op = 0; op < op_n; ++op) {
+			hist_merge(&(total[op]), &(workers[it].hist[op]));
+			ops[op] += workers[it].ops[op];
+			hits[op] += workers[it].hits[op];
+			total_ops += workers[it].ops[op];
+		}
+	}
+
+	printf("%s: %lu ops in %.3fs, %.2f Mops/s\n", name, (unsigned long)total_ops, elapsed, total_ops / elapsed * 1e-6);
+	for (size_t op = 0; op < op_n; ++op) {
+		struct hist *hist = &(total[op]);
+		if (ops[op] == 0) {
+			continue;
+		}
+		printf(
+			"  %-6s n=%-10lu found=%5.1f%% p50=%luns p90=%luns p99=%luns p99.9=%luns max=%luns\n",
+			op_name[op], (unsigned long)ops[op], hits[op] * 100.0 / ops[op],
+			(unsigned long)hist_percentile(hist, 0.5),
+			(unsigned long)hist_percentile(hist, 0.9),
+			(unsigned long)hist_percentile(hist, 0.99),
+			(unsigned long)hist_percentile(hist, 0.999),
+			(unsigned long)hist->max
+		);
+	}
+	struct hashmap_stats stats;
+	uint64_t n_buckets = bench_stats(&(stats));
+	printf(
+		"  n_buckets=%lu load_factor=%.3f\n",
+		(unsigned long)n_buckets, stats.load_factor
+	);
+	#if HASHMAP_STATS
+	// counters are cumulative over every phase so far
+	printf(
+		"  resizes=%lu resize_ms=%.3f resize_wait_ms=%.3f lock_spins=%lu lock_parks=%lu reserve_refills=%lu\n  psl:",
+		(unsigned long)stats.resizes, stats.resize_ns * 1e-6, stats.resize_wait_ns * 1e-6,
+		(unsigned long)stats.lock_spins, (unsigned long)stats.lock_parks, (unsigned long)stats.reserve_refills
+	);
+	for (size_t idx = 0; idx < HASHMAP_STATS_PSL_N; ++idx) {
+		printf(" %lu", (unsigned long)stats.psl[idx]);
+	}
+	printf("\n");
+	#endif
+	return;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -t threads            (default 8)\n"
+		"  -n key space size     (default 4194304)\n"
+		"  -o mixed-phase ops    (default 16777216, split over the threads)\n"
+		"  -k key size in bytes  (4..256, default 8)\n"
+		"  -d uniform|zipf|seq   key distribution (default uniform)\n"
+		"  -z zipf theta         (default 0.99)\n"
+		"  -m read:write:delete  percentages (default 90:9:1)\n"
+		"  -i initial size log2  (default: pre-sized for -n keys; small values give a resize-heavy run)\n"
+		"  -f resize_percentage  (default 0.94)\n"
+		"  -s shrink_percentage  (default 0)\n"
+		"  -e N                  time every Nth op only (default 1)\n"
+		"  -P                    skip the preload phase\n"
+		"  -c                    announce -n keys with hashmap_ensure_capacity before the preload\n"
+		"  -a                    writes are counter increments with hashmap_fetch_add\n"
+		"  -S shard bits         use a hashmap_sharded with 2^bits shards (default 0: a plain hashmap)\n"
+		"  -w spins:backoff      bucket lock waiting, see hashmap_wait_tune (default %u:%u)\n",
+		argv0, HASHMAP_WAIT_SPINS, HASHMAP_WAIT_BACKOFF
+	);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	int c;
+	while ((c = getopt(argc, argv, "t:n:o:k:d:z:m:i:f:s:e:PcaS:w:h")) != -1) {
+		switch (c) {
+			case 't': opt.n_threads = strtoul(optarg, NULL, 0); break;
+			case 'n': opt.n_keys = strtoull(optarg, NULL, 0); break;
+			case 'o': opt.n_ops = strtoull(optarg, NULL, 0); break;
+			case 'k': opt.key_sz = strtoul(optarg, NULL, 0); break;
+			case 'd': {
+				if (strcmp(optarg, "uniform") == 0) {
+					opt.dist = dist_uniform;
+				} else if (strcmp(optarg, "zipf") == 0) {
+					opt.dist = dist_zipf;
+				} else if (strcmp(optarg, "seq") == 0) {
+					opt.dist = dist_seq;
+				} else {
+					usage(argv[0]);
+				}
+				break;
+			}
+			case 'z': opt.zipf_theta = strtod(optarg, NULL); break;
+			case 'm': {
+				if (sscanf(optarg, "%u:%u:%u", &(opt.read_pct), &(opt.write_pct), &(opt.delete_pct)) != 3) {
+					usage(argv[0]);
+				}
+				break;
+			}
+			case 'i': opt.initial_size_log2 = atoi(optarg); break;
+			case 'f': opt.resize_percentage = strtof(optarg, NULL); break;
+			case 's': opt.shrink_percentage = strtof(optarg, NULL); break;
+			case 'e': opt.sample = strtoul(optarg, NULL, 0); break;
+			case 'P': opt.preload = false; break;
+			case 'c': opt.ensure_capacity = true; break;
+			case 'a': opt.fetch_add = true; break;
+			case 'S': opt.shard_bits = strtoul(optarg, NULL, 0); break;
+			case 'w': {
+				if (sscanf(optarg, "%u:%u", &(opt.wait_spins), &(opt.wait_backoff)) != 2) {
+					usage(argv[0]);
+				}
+				break;
+			}
+			default: usage(argv[0]);
+		}
+	}
+	if (
+		opt.n_threads == 0 || opt.n_threads > UINT16_MAX || opt.n_keys == 0 ||
+		opt.key_sz < 4 || opt.key_sz > 256 || opt.sample == 0 ||
+		opt.read_pct + opt.write_pct + opt.delete_pct != 100 ||
+		opt.zipf_theta <= 0 || opt.zipf_theta >= 1 ||
+		opt.shard_bits > HASHMAP_SHARD_BITS_MAX
+	) {
+		usage(argv[0]);
+	}
+
+	if (opt.initial_size_log2 < 0) {
+		// pre-size, so that loading opt.n_keys keys never resizes
+		// (with -S, each shard is sized for its share, plus some slack)
+		uint64_t n_keys = opt.shard_bits == 0 ? opt.n_keys : (opt.n_keys >> opt.shard_bits) * 9 / 8;
+		opt.initial_size_log2 = 0;
+		while (((uint64_t)1 << opt.initial_size_log2) * opt.resize_percentage < n_keys + 1024) {
+			opt.initial_size_log2 += 1;
+		}
+	}
+	if (opt.dist == dist_zipf) {
+		zipf_init(&(the_zipf), opt.n_keys, opt.zipf_theta);
+	}
+
+	printf(
+		"threads=%u keys=%lu key_sz=%u dist=%s mix=%u:%u:%u initial_size_log2=%d resize=%.2f shrink=%.2f shard_bits=%u wait=%u:%u\n",
+		opt.n_threads, (unsigned long)opt.n_keys, opt.key_sz,
+		opt.dist == dist_uniform ? "uniform" : opt.dist == dist_zipf ? "zipf" : "seq",
+		opt.read_pct, opt.write_pct, opt.delete_pct,
+		opt.initial_size_log2, opt.resize_percentage, opt.shrink_percentage, opt.shard_bits,
+		opt.wait_spins, opt.wait_backoff
+	);
+	printf(
+		"HASHMAP_CTRL=%d HASHMAP_INLINE_KEY_SZ=%d HASHMAP_MIN_RESERVE=%d HASHMAP_INCREMENTAL_RESIZE=%d HASHMAP_64=%d HASHMAP_GROWTH_SHIFT=%d HASHMAP_BUCKET_GROUPS=%d HASHMAP_HUGE_PAGES=%d HASHMAP_NUMA=%d HASHMAP_CACHE=%d HASHMAP_FUTEX=%d\n",
+		HASHMAP_CTRL, HASHMAP_INLINE_KEY_SZ, HASHMAP_MIN_RESERVE, HASHMAP_INCREMENTAL_RESIZE, HASHMAP_64, HASHMAP_GROWTH_SHIFT, HASHMAP_BUCKET_GROUPS,
+		HASHMAP_HUGE_PAGES, HASHMAP_NUMA, HASHMAP_CACHE, HASHMAP_FUTEX
+	);
+
+	if (opt.shard_bits != 0) {
+		the_sharded = hashmap_sharded_create(
+			opt.shard_bits,
+			opt.n_threads, opt.initial_size_log2,
+			opt.resize_percentage, opt.shrink_percentage,
+			NULL
+		);
+		if (the_sharded == NULL) {
+			fprintf(stderr, "hashmap_sharded_create failed\n");
+			return 1;
+		}
+		for (size_t shard = 0; shard < ((size_t)1 << opt.shard_bits); ++shard) {
+			hashmap_wait_tune(the_sharded->shards[shard], opt.wait_spins, opt.wait_backoff);
+		}
+	} else {
+		the_hashmap = hashmap_create(
+			opt.n_threads, opt.initial_size_log2,
+			opt.resize_percentage, opt.shrink_percentage,
+			NULL
+		);
+		if (the_hashmap == NULL) {
+			fprintf(stderr, "hashmap_create failed\n");
+			return 1;
+		}
+		hashmap_wait_tune(the_hashmap, opt.wait_spins, opt.wait_backoff);
+	}
+
+	if (opt.ensure_capacity) {
+		uint64_t start = now_ns();
+		bool ok = true;
+		if (the_sharded != NULL) {
+			struct hashmap_sharded_area *area = hashmap_sharded_area(the_sharded);
+			for (size_t shard = 0; shard < ((size_t)1 << opt.shard_bits); ++shard) {
+				ok = ok && hashmap_ensure_capacity(
+					the_sharded->shards[shard], area->areas[shard],
+					(opt.n_keys >> opt.shard_bits) * 9 / 8
+				);
+			}
+			hashmap_sharded_area_release(the_sharded, area);
+		} else {
+			struct hashmap_area *area = hashmap_area(the_hashmap);
+			ok = hashmap_ensure_capacity(the_hashmap, area, opt.n_keys);
+			hashmap_area_release(the_hashmap, area);
+		}
+		if (!ok) {
+			fprintf(stderr, "hashmap_ensure_capacity failed\n");
+			return 1;
+		}
+		printf("ensure_capacity: %.3f ms\n", (now_ns() - start) / 1e6);
+	}
+
+	struct worker *workers = calloc(opt.n_threads, sizeof(struct worker));
+	if (workers == NULL) {
+		return 1;
+	}
+	for (unsigned int it = 0; it < opt.n_threads; ++it) {
+		workers[it].id = it;
+		workers[it].seed = 0x9e3779b97f4a7c15ull * (it + 1) | 1;
+	}
+	pthread_barrier_init(&(start_barrier), NULL, opt.n_threads + 1);
+
+	if (opt.preload) {
+		run_phase("preload", workers, preload_thread);
+	}
+	run_phase("mixed", workers, mixed_thread);
+
+	if (the_sharded != NULL) {
+		hashmap_sharded_destroy(the_sharded);
+	} else {
+		// every worker thread takes a share of the buckets
+		hashmap_destroy_parallel_init(the_hashmap, &(destroy_job));
+		for (unsigned int it = 0; it < opt.n_threads; ++it) {
+			pthread_create(&(workers[it].thread), NULL, destroy_thread, &(workers[it]));
+		}
+		pthread_barrier_wait(&(start_barrier));
+		// every worker returns once the whole destroy is done
+		uint64_t elapsed = 0;
+		for (unsigned int it = 0; it < opt.n_threads; ++it) {
+			pthread_join(workers[it].thread, NULL);
+			if (workers[it].destroy_ns > elapsed) {
+				elapsed = workers[it].destroy_ns;
+			}
+		}
+		printf("destroy: %.3f ms\n", elapsed / 1e6);
+	}
+
+	pthread_barrier_destroy(&(start_barrier));
+	free(workers);
+	return 0;
+}
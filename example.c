@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
 #include <stdatomic.h>
@@ -10,7 +11,7 @@ double rc(void) {
     return now.tv_sec + (now.tv_nsec * 1e-9);
 }
 
-#define HASHMAP_HASH_FUNCTION(key, key_sz) (*(uint64_t *)key ^ 9268326398)
+#define HASHMAP_INLINE_KEY_SZ 8
 #include "src/hashmap.h"
 
 #define N_THREADS 8
@@ -19,8 +20,6 @@ double rc(void) {
 struct hashmap *the_hashmap;
 
 void *writet(void *_) {
-	while (nolock) hashmap_mpause();
-
 	static atomic_uint_fast32_t chunk = 0;
 	static const uint_fast32_t CHUNK_SZ = 1024;
 
@@ -57,8 +56,6 @@ void *writet(void *_) {
 }
 
 void *readt(void *_) {
-	//while (!nolock) hashmap_mpause();
-
 	static atomic_uint_fast32_t chunk = 0;
 	static const uint_fast32_t CHUNK_SZ = 1024;
 
@@ -95,8 +92,6 @@ void *readt(void *_) {
 }
 
 void *deletet(void *_) {
-	while (nolock) hashmap_mpause();
-
 	static atomic_uint_fast32_t chunk = 0;
 	static const uint_fast32_t CHUNK_SZ = 1024;
 
@@ -136,7 +131,7 @@ void *deletet(void *_) {
 
 int main(int argc, char *argv[]) {
 	the_hashmap = hashmap_create(
-		N_THREADS, 25, 0.8,
+		N_THREADS, 25, 0.8, 0,
 		NULL
 	);
 	if (the_hashmap == NULL) {
@@ -161,7 +156,6 @@ int main(int argc, char *argv[]) {
 	for (size_t x = 0; x < N_THREADS; ++x) {
 		pthread_create(&(threads[x]), NULL, (void *)&(readt), NULL);
 	}
-	//nolock = true;
 	time = rc();
 	for (size_t x = 0; x < N_THREADS; ++x) {
 		void *fuck;
@@ -173,7 +167,6 @@ int main(int argc, char *argv[]) {
 	for (size_t x = 0; x < N_THREADS; ++x) {
 		pthread_create(&(threads[x]), NULL, (void *)&(deletet), NULL);
 	}
-	nolock = false;
 	time = rc();
 	for (size_t x = 0; x < N_THREADS; ++x) {
 		void *fuck;
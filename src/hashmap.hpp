@@ -0,0 +1,393 @@
+/*
+	ISC License
+
+	Copyright (c) 2023, aiden (aiden@cmp.bz)
+
+	Permission to use, copy, modify, and/or distribute this software for any
+	purpose with or without fee is hereby granted, provided that the above
+	copyright notice and this permission notice appear in all copies.
+
+	THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+	WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+	MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+	ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+	WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+	ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+	OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#ifndef HASHMAP_HPP
+#define HASHMAP_HPP
+
+// c++17 front-end for hashmap.h: hm::hashmap<K, V, Hash, Policy>.
+//
+// hashmap.h is c11 (_Atomic, implicit void * conversions), so c++ only sees
+// the declarations at its top. exactly one c file of the program compiles
+// the functions with external linkage instead:
+//
+//	// hashmap.c
+//	#define HASHMAP_API
+//	#include "hashmap.h"
+//
+// every operation is a call into that file, which must be built with the
+// same HASHMAP_64, HASHMAP_EPOCH and HASHMAP_HASH_FUNCTION as the c++ code
+// that includes this header; the constructor checks that they agree (see
+// hashmap_abi). hashing, and key and value encoding, are inlined on the c++
+// side. visit (for boxed values) and for_each hand their callables to the c
+// side through function pointers.
+//
+// keys are handed to the c side as bytes (see hm::key_traits): trivially
+// copyable keys without padding as their object representation, whose 4, 8
+// and 16 byte sizes are compared with integer compares (and stored in the
+// bucket up to HASHMAP_INLINE_KEY_SZ), and strings as their characters.
+// values that are trivially copyable and fit in a pointer are stored in the
+// bucket's value word; any other value is moved into a heap box that the
+// map owns and destroys, so values may be move-only (see hm::default_policy).
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "hashmap.h"
+
+namespace hm {
+
+// how a key is handed to the c side: as size(key) bytes at data(key).
+// load rebuilds a key from those bytes (for for_each).
+template <typename K, typename = void>
+struct key_traits {
+	static_assert(
+		std::is_void_v<K> && !std::is_void_v<K>,
+		"no hm::key_traits for this key type; specialize it"
+	);
+};
+// the object representation of keys without padding (and without
+// floating-point members, whose equal values can differ in their bytes)
+template <typename K>
+struct key_traits<K, std::enable_if_t<std::has_unique_object_representations_v<K>>> {
+	static constexpr bool fixed_size = true;
+	static const void *data(const K &key) {
+		return &(key);
+	}
+	static constexpr uint32_t size(const K &) {
+		return sizeof(K);
+	}
+	static K load(const void *bytes, uint32_t) {
+		K key;
+		std::memcpy(&(key), bytes, sizeof(K));
+		return key;
+	}
+};
+template <typename C, typename T, typename A>
+struct key_traits<std::basic_string<C, T, A>> {
+	static constexpr bool fixed_size = false;
+	static const void *data(const std::basic_string<C, T, A> &key) {
+		return key.data();
+	}
+	static uint32_t size(const std::basic_string<C, T, A> &key) {
+		return (uint32_t)(key.size() * sizeof(C));
+	}
+	static std::basic_string<C, T, A> load(const void *bytes, uint32_t size) {
+		return std::basic_string<C, T, A>(static_cast<const C *>(bytes), size / sizeof(C));
+	}
+};
+// keys loaded by for_each view the map's copy, and are only valid during the callback
+template <typename C, typename T>
+struct key_traits<std::basic_string_view<C, T>> {
+	static constexpr bool fixed_size = false;
+	static const void *data(std::basic_string_view<C, T> key) {
+		return key.data();
+	}
+	static uint32_t size(std::basic_string_view<C, T> key) {
+		return (uint32_t)(key.size() * sizeof(C));
+	}
+	static std::basic_string_view<C, T> load(const void *bytes, uint32_t size) {
+		return std::basic_string_view<C, T>(static_cast<const C *>(bytes), size / sizeof(C));
+	}
+};
+
+// the hash that hashmap_key computes on the c side
+struct default_hash {
+	template <typename K>
+	hashmap_hash operator()(const K &key) const {
+		return (hashmap_hash)HASHMAP_HASH_FUNCTION(
+			const_cast<void *>(key_traits<K>::data(key)),
+			key_traits<K>::size(key)
+		);
+	}
+};
+
+// inline_value: V is stored in the bucket's value word rather than boxed.
+// a policy may set it to false for any V, but only to true for a V that
+// qualifies here.
+template <typename K, typename V>
+struct default_policy {
+	using keys = key_traits<K>;
+	static constexpr bool inline_value =
+		std::is_trivially_copyable_v<V> &&
+		sizeof(V) <= sizeof(void *) &&
+		alignof(V) <= alignof(void *);
+};
+
+template <
+	typename K,
+	typename V,
+	typename Hash = default_hash,
+	typename Policy = default_policy<K, V>
+>
+class hashmap {
+	using keys = typename Policy::keys;
+	static constexpr bool inline_value = Policy::inline_value;
+	static_assert(
+		!inline_value || (std::is_trivially_copyable_v<V> && sizeof(V) <= sizeof(void *)),
+		"only trivially copyable values that fit in a pointer can be stored inline"
+	);
+
+	::hashmap *map;
+	[[no_unique_address]] Hash hash;
+
+	static void *encode(V &&value) {
+		if constexpr (inline_value) {
+			void *word = nullptr;
+			std::memcpy(&(word), &(value), sizeof(V));
+			return word;
+		} else {
+			return new V(std::move(value));
+		}
+	}
+	static V decode(void *word) {
+		// V need not be default-constructible
+		alignas(V) unsigned char storage[sizeof(V)];
+		std::memcpy(storage, &(word), sizeof(V));
+		return *std::launder(reinterpret_cast<V *>(storage));
+	}
+	static void discard(void *word) {
+		if constexpr (!inline_value) {
+			delete static_cast<V *>(word);
+		}
+	}
+
+	// passed as the callback_arg of gets, so that the acquire
+	// callback can read a boxed value while its bucket is locked
+	struct visitor {
+		void (*fn)(void *ctx, const V &value);
+		void *ctx;
+	};
+	static void callback(void *entry, hashmap_callback_reason reason, void *arg) {
+		if (reason == hashmap_acquire) {
+			if (arg != nullptr) {
+				visitor *vis = static_cast<visitor *>(arg);
+				vis->fn(vis->ctx, *static_cast<const V *>(entry));
+			}
+			return;
+		}
+		discard(entry);
+		return;
+	}
+
+	// a callable (which may be const) as the void * argument of a c callback
+	template <typename F>
+	static void *context(F &fn) {
+		return const_cast<void *>(static_cast<const void *>(&(fn)));
+	}
+
+	hashmap_key make_key(const K &key) const {
+		hashmap_key hm_key;
+		hm_key.key = const_cast<void *>(keys::data(key));
+		hm_key.key_sz = keys::size(key);
+		hm_key.hash = hash(key);
+		return hm_key;
+	}
+
+public:
+	// an area of the map, released when it is destroyed.
+	// each thread that uses the map holds its own.
+	class area {
+		friend class hashmap;
+		::hashmap *map;
+		struct ::hashmap_area *handle;
+		explicit area(::hashmap *map) : map(map), handle(hashmap_area(map)) {}
+	public:
+		area(area &&other) noexcept : map(other.map), handle(std::exchange(other.handle, nullptr)) {}
+		area &operator=(area &&other) noexcept {
+			if (this != &(other)) {
+				if (handle != nullptr) {
+					hashmap_area_release(map, handle);
+				}
+				map = other.map;
+				handle = std::exchange(other.handle, nullptr);
+			}
+			return *this;
+		}
+		area(const area &) = delete;
+		area &operator=(const area &) = delete;
+		~area() {
+			if (handle != nullptr) {
+				hashmap_area_release(map, handle);
+			}
+		}
+	};
+
+	// see hashmap_create. throws std::bad_alloc if it fails, and
+	// std::logic_error if hashmap.h's functions were compiled with another
+	// HASHMAP_64, HASHMAP_EPOCH or HASHMAP_HASH_FUNCTION than this code.
+	explicit hashmap(
+		uint16_t n_threads,
+		uint8_t initial_size_log2 = 0,
+		float resize_percentage = 0.94f,
+		float shrink_percentage = 0,
+		Hash hash = Hash()
+	) : hash(std::move(hash)) {
+		if (hashmap_abi() != _hashmap_abi()) {
+			throw std::logic_error("hashmap.h was compiled with other settings than hashmap.hpp");
+		}
+		map = hashmap_create(
+			n_threads, initial_size_log2,
+			resize_percentage, shrink_percentage,
+			inline_value ? nullptr : &(callback)
+		);
+		if (map == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+	hashmap(const hashmap &) = delete;
+	hashmap &operator=(const hashmap &) = delete;
+	// every area must have been destroyed
+	~hashmap() {
+		hashmap_destroy(map);
+	}
+
+	area make_area() {
+		return area(map);
+	}
+
+	// inserts key if it is absent. returns false (and destroys
+	// value) if it is present. throws std::bad_alloc if it fails.
+	bool insert(area &area, const K &key, V value) {
+		hashmap_key hm_key = make_key(key);
+		void *word = encode(std::move(value));
+		void *current;
+		switch (hashmap_cas(map, area.handle, &(hm_key), &(current), word, hashmap_cas_insert, nullptr)) {
+			case hashmap_cas_success: {
+				return true;
+			}
+			case hashmap_cas_again: {
+				discard(word);
+				return false;
+			}
+			default: {
+				discard(word);
+				throw std::bad_alloc();
+			}
+		}
+	}
+
+	// returns true if key was inserted, false if its value was replaced.
+	// throws std::bad_alloc if it fails.
+	bool insert_or_assign(area &area, const K &key, V value) {
+		hashmap_key hm_key = make_key(key);
+		void *word = encode(std::move(value));
+		void *replaced;
+		switch (hashmap_cas(map, area.handle, &(hm_key), &(replaced), word, hashmap_cas_set_any, nullptr)) {
+			case hashmap_cas_success: {
+				return true;
+			}
+			case hashmap_cas_again: {
+				// the callback has dropped the replaced value
+				return false;
+			}
+			default: {
+				discard(word);
+				throw std::bad_alloc();
+			}
+		}
+	}
+
+	// returns false if key is absent
+	bool erase(area &area, const K &key) {
+		hashmap_key hm_key = make_key(key);
+		void *current;
+		return hashmap_cas(map, area.handle, &(hm_key), &(current), nullptr, hashmap_cas_delete_any, nullptr) == hashmap_cas_success;
+	}
+
+	// removes every entry. nothing else may use the map meanwhile,
+	// and with HASHMAP_EPOCH, no area may be in an epoch section.
+	void clear() {
+		hashmap_clear(map);
+	}
+
+	// calls fn(const V &) if key is present, and returns whether it was.
+	// a boxed value is only valid during the call, which happens under
+	// the bucket's lock (or, with HASHMAP_EPOCH, inside an epoch section).
+	template <typename F>
+	bool visit(area &area, const K &key, F &&fn) {
+		hashmap_key hm_key = make_key(key);
+		void *value;
+		if constexpr (inline_value) {
+			if (hashmap_cas(map, area.handle, &(hm_key), &(value), nullptr, hashmap_cas_get, nullptr) != hashmap_cas_again) {
+				return false;
+			}
+			const V copy = decode(value);
+			fn(copy);
+			return true;
+		} else {
+			#if HASHMAP_EPOCH
+			hashmap_epoch_enter(map, area.handle);
+			bool found = hashmap_cas(map, area.handle, &(hm_key), &(value), nullptr, hashmap_cas_get, nullptr) == hashmap_cas_again;
+			if (found) {
+				fn(*static_cast<const V *>(value));
+			}
+			hashmap_epoch_exit(map, area.handle);
+			return found;
+			#else
+			visitor vis = {
+				[](void *ctx, const V &value) {
+					(*static_cast<std::remove_reference_t<F> *>(ctx))(value);
+				},
+				context(fn),
+			};
+			return hashmap_cas(map, area.handle, &(hm_key), &(value), nullptr, hashmap_cas_get, &(vis)) == hashmap_cas_again;
+			#endif
+		}
+	}
+
+	// a copy of key's value, if key is present
+	std::optional<V> get(area &area, const K &key) {
+		static_assert(std::is_copy_constructible_v<V>, "use visit for values that cannot be copied");
+		std::optional<V> result;
+		visit(area, key, [&](const V &value) {
+			result.emplace(value);
+		});
+		return result;
+	}
+
+	// calls fn(const K &, const V &) on every entry; see hashmap_scan
+	// for what a scan sees of concurrent changes. fn must not use the map.
+	template <typename F>
+	void for_each(area &area, F &&fn) {
+		hashmap_scan_callback thunk = [](hashmap_key *key, void *value, void *arg) {
+			const K loaded = keys::load(key->key, key->key_sz);
+			if constexpr (inline_value) {
+				const V copy = decode(value);
+				(*static_cast<std::remove_reference_t<F> *>(arg))(loaded, copy);
+			} else {
+				(*static_cast<std::remove_reference_t<F> *>(arg))(loaded, *static_cast<const V *>(value));
+			}
+		};
+		uint64_t cursor = 0;
+		do {
+			cursor = hashmap_scan(map, area.handle, cursor, 64, thunk, context(fn));
+		} while (cursor != 0);
+	}
+};
+
+}
+
+#endif
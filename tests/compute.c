@@ -0,0 +1,93 @@
+// hashmap_compute and hashmap_fetch_add from several threads while the
+// buckets array grows incrementally under them.
+// cc -std=gnu11 -O2 -pthread tests/compute.c -o compute && ./compute
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define HASHMAP_INCREMENTAL_RESIZE 1
+#include "../src/hashmap.h"
+
+#define N_THREADS 4
+#define N_KEYS 200000
+#define N_ROUNDS 4
+
+struct hashmap *the_hashmap;
+
+// counts the calls per key in the upper half of the value
+static enum hashmap_compute_result count(bool present, void **value, void *arg) {
+	(void)arg;
+	uintptr_t x = present ? (uintptr_t)*value : 0;
+	*value = (void *)(x + ((uintptr_t)1 << 16));
+	return hashmap_compute_set;
+}
+
+void *computet(void *arg) {
+	uintptr_t id = (uintptr_t)arg;
+
+	struct hashmap_key key;
+
+	struct hashmap_area *area = hashmap_area(the_hashmap);
+
+	for (uint_fast32_t round = 0; round < N_ROUNDS; ++round) {
+		// every thread starts somewhere else, so that inserts
+		// race with updates of the same keys
+		for (uint_fast32_t i = 0; i < N_KEYS; ++i) {
+			uint64_t idx = (i + id * (N_KEYS / N_THREADS)) % N_KEYS;
+			hashmap_key(&(idx), sizeof(idx), &(key));
+			enum hashmap_cas_result result = (idx & 1) ?
+				hashmap_compute(the_hashmap, area, &(key), count, NULL) :
+				hashmap_fetch_add(the_hashmap, area, &(key), 1, NULL);
+			if (result != hashmap_cas_success) {
+				printf("error at key %llu!\n", (unsigned long long)idx);
+				exit(1);
+			}
+		}
+	}
+
+	hashmap_area_release(the_hashmap, area);
+	return NULL;
+}
+
+int main(void) {
+	// starts small, so that it resizes many times
+	the_hashmap = hashmap_create(N_THREADS + 1, 4, 0.94, 0, NULL);
+	if (the_hashmap == NULL) {
+		puts("error!");
+		return 1;
+	}
+
+	pthread_t threads[N_THREADS];
+	for (uintptr_t idx = 0; idx < N_THREADS; ++idx) {
+		pthread_create(&(threads[idx]), NULL, computet, (void *)idx);
+	}
+	for (uintptr_t idx = 0; idx < N_THREADS; ++idx) {
+		pthread_join(threads[idx], NULL);
+	}
+
+	struct hashmap_area *area = hashmap_area(the_hashmap);
+	size_t wrong = 0;
+	for (uint64_t idx = 0; idx < N_KEYS; ++idx) {
+		struct hashmap_key key;
+		hashmap_key(&(idx), sizeof(idx), &(key));
+		void *value;
+		uintptr_t expected = (uintptr_t)(N_THREADS * N_ROUNDS) << ((idx & 1) ? 16 : 0);
+		if (hashmap_cas(
+			the_hashmap, area, &(key),
+			&(value), NULL,
+			hashmap_cas_get, NULL
+		) != hashmap_cas_again || (uintptr_t)value != expected) {
+			wrong += 1;
+		}
+	}
+	hashmap_area_release(the_hashmap, area);
+	hashmap_destroy(the_hashmap);
+
+	if (wrong != 0) {
+		printf("%zu keys have the wrong count!\n", wrong);
+		return 1;
+	}
+	puts("ok");
+	return 0;
+}